@@ -7,6 +7,14 @@
 *					2018-02-23 => 实现了ScanLine绘制出完整的三角形面积.
 *					2018-02-27 => 实现了zbuffer的支持.
 *					2018-03-07 => 实现了简单裁剪及纹理映射.
+*					2026-10-18 => 深度缓冲支持反向Z浮点, 24位及16位格式, 每次绘制可设置深度测试函数.
+*					2026-10-18 => 增量绘制, 只重绘物体新旧屏幕包围盒的脏矩形区域.
+*					2026-10-18 => Bresenham画任意斜率的线(裁剪, 深度测试, 线宽), 批量绘制点精灵.
+*					2026-10-18 => RGBA颜色与纹理, 混合方程(SSE按扫描线混合), 按tile排序的透明pass及k-buffer顺序无关透明.
+*					2026-10-18 => 延迟着色: 紧凑G-buffer, 多线程按tile剔除光源的光照pass.
+*					2026-10-18 => 渲染目标(可作为纹理采样), 只写深度的快速光栅化路径, 阴影贴图.
+*					2026-10-18 => BC1压缩纹理, 采样时通过每线程LRU缓存解码4x4块.
+*					2026-10-18 => 帧缓冲回读接口, 按行多线程SSE转换为RGBA8/BGRA8/RGB565/浮点RGB/YUV420及线性深度.
 *
 * Author        :	Ryan Zheng
 * Detail        :	在win32窗体下实现简单的软件光栅化渲染器.√
@@ -18,7 +26,7 @@
 *				6,	zbuffer实现和绘制立方体.√
 *				7,	空间裁剪.√
 *				8,	纹理映射.√
-*				9,	简单光照×
+*				9,	简单光照√
 * Quote			:
 				1, Perspective Texture Mapping : http://chrishecker.com/Miscellaneous_Technical_Articles
 				2, About clipping1 : https://fgiesen.wordpress.com/2011/07/05/a-trip-through-the-graphics-pipeline-2011-part-5/
@@ -35,11 +43,32 @@
 * ----------------------------------------------------------------------------------------------------------------- */
 #include <windows.h>
 #include <math.h>
+#include <float.h>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <emmintrin.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #define SCREEN_WIDTH 800
 #define SCREEN_HEIGHT 600
 #define PIX_BITS 24
+#define TILE_SIZE 64
+#define KBUFFER_LAYERS 4
+#define LIGHT_TILE_SIZE 16
+#define BLOCK_CACHE_SETS 16
+#define BLOCK_CACHE_WAYS 4
+
+//v120 has no thread_local yet.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL thread_local
+#endif
 
 #pragma region Color & Matrix4 & Vector4 & Camera & Device
 
@@ -50,14 +79,67 @@ enum DRAW_TYPE
 	DRAW_TRIANGLE,
 };
 
+enum DEPTH_FORMAT
+{
+	DEPTH_FLOAT = 1,
+	DEPTH_FLOAT_REVERSED,
+	DEPTH_24,
+	DEPTH_16,
+};
+
+enum DEPTH_FUNC
+{
+	DEPTH_LESS = 1,
+	DEPTH_LEQUAL,
+	DEPTH_ALWAYS,
+	DEPTH_NONE,
+};
+
+enum BLEND_MODE
+{
+	BLEND_NONE = 1,
+	BLEND_ALPHA,
+	BLEND_ADDITIVE,
+	BLEND_MULTIPLY,
+};
+
+enum TRANSPARENCY_MODE
+{
+	TRANSPARENCY_SORTED = 1,
+	TRANSPARENCY_KBUFFER,
+};
+
+enum TEXTURE_FORMAT
+{
+	TEXTURE_ARGB = 1,
+	TEXTURE_BC1,
+};
+
+//Readback formats of Device::ReadPixels, bytes are listed in memory order.
+enum PIXEL_FORMAT
+{
+	PIXEL_RGBA8 = 1,
+	PIXEL_BGRA8,
+	PIXEL_RGB565,
+	PIXEL_RGB_FLOAT,
+	PIXEL_YUV420,
+	PIXEL_DEPTH_LINEAR,
+};
+
+enum LIGHT_TYPE
+{
+	LIGHT_DIRECTIONAL = 1,
+	LIGHT_POINT,
+};
+
 class Color
 {
 public:
-	int r, g, b;
+	int r, g, b, a;
 public:
-	Color(int _r, int _g, int _b) { r = _r; g = _g; b = _b; }
+	Color(int _r = 0, int _g = 0, int _b = 0, int _a = 255) { r = _r; g = _g; b = _b; a = _a; }
 
-	static Color Black() { return (*(new Color(0, 0, 0))); }
+	static Color Black() { return Color(0, 0, 0); }
 };
 
 class Matrix4
@@ -172,6 +254,53 @@ public:
 		mm[1][0] = mm[1][2] = mm[1][3] = 0;
 		mm[2][0] = mm[2][1] = mm[2][3] = 0;
 	}
+
+	//Gauss-Jordan elimination with partial pivoting, identity for a singular matrix.
+	Matrix4 Inverse()
+	{
+		float a[4][8];
+		for (int i = 0; i < 4; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				a[i][j] = mm[i][j];
+				a[i][j + 4] = (i == j) ? 1.0f : 0;
+			}
+		}
+
+		for (int col = 0; col < 4; col++)
+		{
+			int pivot = col;
+			for (int row = col + 1; row < 4; row++)
+			{
+				if (fabs(a[row][col]) > fabs(a[pivot][col])) pivot = row;
+			}
+			if (fabs(a[pivot][col]) < 1e-8f) return Matrix4();
+
+			for (int j = 0; j < 8; j++)
+			{
+				float temp = a[col][j]; a[col][j] = a[pivot][j]; a[pivot][j] = temp;
+			}
+
+			float scale = 1 / a[col][col];
+			for (int j = 0; j < 8; j++) a[col][j] *= scale;
+
+			for (int row = 0; row < 4; row++)
+			{
+				if (row == col) continue;
+				float factor = a[row][col];
+				for (int j = 0; j < 8; j++) a[row][j] -= factor * a[col][j];
+			}
+		}
+
+		Matrix4 ret;
+		for (int i = 0; i < 4; i++)
+		{
+			for (int j = 0; j < 4; j++) ret.mm[i][j] = a[i][j + 4];
+		}
+
+		return ret;
+	}
 };
 
 class Vector4
@@ -267,7 +396,30 @@ public:
 	Rect(float x1 = 0 , float y1 = 0, float x2 = 0, float y2 = 0) { _x1 = x1; _y1 = y1; _x2 = x2; _y2 = y2; }
 	bool InRegion(float x, float y)
 	{
-		return x >= _x1 && x <= _x2 && y >= _y1 && y >= _y2;
+		return x >= _x1 && x <= _x2 && y >= _y1 && y <= _y2;
+	}
+
+	bool IsEmpty() const
+	{
+		return _x2 <= _x1 || _y2 <= _y1;
+	}
+
+	bool operator==(const Rect& rect) const
+	{
+		return _x1 == rect._x1 && _y1 == rect._y1 && _x2 == rect._x2 && _y2 == rect._y2;
+	}
+
+	Rect Union(const Rect& rect) const
+	{
+		if (IsEmpty()) return rect;
+		if (rect.IsEmpty()) return *this;
+
+		return Rect(min(_x1, rect._x1), min(_y1, rect._y1), max(_x2, rect._x2), max(_y2, rect._y2));
+	}
+
+	Rect Intersect(const Rect& rect) const
+	{
+		return Rect(max(_x1, rect._x1), max(_y1, rect._y1), min(_x2, rect._x2), min(_y2, rect._y2));
 	}
 };
 
@@ -288,12 +440,31 @@ public:
 	{
 		return Clamp(((1 - rate)*u1 / z1 + rate*u2 / z2) / ((1 - rate) / z1 + rate / z2), 0, 1);
 	}
+
+	/* FNV-1a, continue a hash by passing it back as hash.
+	http://www.isthe.com/chongo/tech/comp/fnv/ */
+	static unsigned int Hash(const void* data, int size, unsigned int hash = 2166136261u)
+	{
+		const BYTE* bytes = (const BYTE*)data;
+		for (int i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 16777619u;
+		}
+
+		return hash;
+	}
 };
 
 class Transform
 {
 public:
 	DRAW_TYPE type;
+	DEPTH_FUNC depthFunc = DEPTH_LESS;
+	int lineWidth = 1;
+	int pointSize = 1;
+	BLEND_MODE blendMode = BLEND_NONE;
+	int alpha = 255;
 	Matrix4 worldMatrix;
 	Matrix4 viewMatrix;
 	Matrix4 projectionMatrix;
@@ -316,6 +487,17 @@ public:
 	{
 		return worldMatrix * viewMatrix * projectionMatrix;
 	}
+
+	//Hash of everything but the matrices that changes what gets drawn.
+	unsigned int StateHash()
+	{
+		int state[6] = { type, depthFunc, lineWidth, pointSize, blendMode, alpha };
+		unsigned int hash = Math::Hash(state, sizeof(state));
+		if (!verticeList.empty()) hash = Math::Hash(&verticeList[0], verticeList.size() * sizeof(float), hash);
+		if (!indiceList.empty()) hash = Math::Hash(&indiceList[0], indiceList.size() * sizeof(int), hash);
+
+		return hash;
+	}
 };
 
 /*
@@ -379,255 +561,1996 @@ public:
 
 		return m;
 	}
+
+	/* Same as Perspective, but maps near to 1 and far to 0, for DEPTH_FLOAT_REVERSED.
+	https://developer.nvidia.com/content/depth-precision-visualized */
+	Matrix4 PerspectiveReversed(float angle, float aspect, float nearClip, float farClip)
+	{
+		Matrix4 m = Perspective(angle, aspect, nearClip, farClip);
+		float n = nearClip;
+		float f = farClip;
+
+		m.SetRow(2, 0, 0, -n / (f - n), 1);
+		m.SetRow(3, 0, 0, f * n / (f - n), 0);
+
+		return m;
+	}
 };
 
-class Device
+/* Depth storage, the clear value and the compare direction depend on the format:
+DEPTH_FLOAT : post-divide z as float, cleared to INT_MAX.
+DEPTH_FLOAT_REVERSED : z from Camera::PerspectiveReversed, bigger is closer, cleared to 0.
+DEPTH_24 / DEPTH_16 : z clamped to [0, 1] and stored as 3 or 2 byte unorm, cleared to 1. */
+class DepthBuffer
 {
 private:
+	DEPTH_FORMAT mFormat;
 	int mWidth;
 	int mHeight;
-	int mTextureWidth;
-	int mTextureHeight;
-	BYTE* mBuf = NULL;
-	float* mZBuf = NULL;
-	unsigned int* mTexture = NULL;
-	BITMAPINFO* mBitmapInfo = NULL;
-	HDC mScreenHDC;
-	HDC mCompatibleDC;
-	HBITMAP mOldBitmap;
-	HBITMAP mCompatibleBitmap;
-	Matrix4 mViewProjection;
+	int mPixelBytes;
+	BYTE* mData = NULL;
 
 public:
-	Device(HWND hwnd, int width = SCREEN_WIDTH, int height = SCREEN_HEIGHT)
+	DepthBuffer(int width, int height, DEPTH_FORMAT format = DEPTH_FLOAT)
 	{
 		mWidth = width;
 		mHeight = height;
-		mBuf = new BYTE[mWidth * mHeight * PIX_BITS / 8];
-		memset(mBuf, 45, mWidth * mHeight * PIX_BITS / 8);
-		mZBuf = new float[mWidth * mHeight];
-		for (int i = 0; i < mWidth*mHeight; i++) mZBuf[i] = (float)INT_MAX;
-
-		mBitmapInfo = new BITMAPINFO();
-		ZeroMemory(mBitmapInfo, sizeof(BITMAPINFO));
-
-		mBitmapInfo->bmiHeader.biBitCount = PIX_BITS;
-		mBitmapInfo->bmiHeader.biCompression = BI_RGB;
-		mBitmapInfo->bmiHeader.biHeight = -mHeight;
-		mBitmapInfo->bmiHeader.biPlanes = 1;
-		mBitmapInfo->bmiHeader.biSizeImage = 0;
-		mBitmapInfo->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-		mBitmapInfo->bmiHeader.biWidth = mWidth;
-
-		mScreenHDC = GetDC(hwnd);
-		mCompatibleDC = CreateCompatibleDC(mScreenHDC);
-		mCompatibleBitmap = CreateCompatibleBitmap(mScreenHDC, mWidth, mHeight);
-		mOldBitmap = (HBITMAP)SelectObject(mCompatibleDC, mCompatibleBitmap);
+		mFormat = format;
+		mPixelBytes = (DEPTH_24 == format) ? 3 : ((DEPTH_16 == format) ? 2 : 4);
+		mData = new BYTE[mWidth * mHeight * mPixelBytes];
+		Clear();
 	}
 
-	/* 
-	https://stackoverflow.com/questions/3792481/how-to-get-screen-coordinates-from-a-3d-point-opengl
-	https://stackoverflow.com/questions/724219/how-to-convert-a-3d-point-into-2d-perspective-projection/866749#866749 */
-	Vector4 GetScreenPos(Transform& transform, Vector4& worldPos)
-	{
-		Vector4 pos = worldPos * transform.WorldViewProjection();
-		bool inClipping = CheckInclipping(pos);
-		pos.x = (pos.x /pos.w + 1)*mWidth/2;
-		pos.y = (1 - pos.y / pos.w)*mHeight/2;
-		pos.z = pos.z / pos.w;
+	~DepthBuffer() { delete[] mData; }
 
-		return pos;
-	}
+	DEPTH_FORMAT Format() { return mFormat; }
 
-	bool CheckInclipping(Vector4 pos)
+	void Clear()
 	{
-		if (pos.z < 0) return false;
-		if (pos.z > pos.w) return false;
-		if (pos.x < -pos.w) return false;
-		if (pos.x > pos.w) return false;
-		if (pos.y < -pos.w) return false;
-		if (pos.y > pos.w) return false;
-
-		return true;
+		Clear(0, 0, mWidth, mHeight);
 	}
 
-	void DrawArrays(Transform& transform)
+	void Clear(int x1, int y1, int x2, int y2)
 	{
-		std::vector<Vector4> screenPoints;
-		std::vector<Vector4> trianglePoints;
-		for (int i = 0; i < transform.indiceList.size(); i++)
+		int count = x2 - x1;
+		for (int y = y1; y < y2; y++)
 		{
-			Vector4 worldPos;
-			int vericeIndex = transform.indiceList[i];
-
-			worldPos.x = transform.verticeList[vericeIndex * 3];
-			worldPos.y = transform.verticeList[vericeIndex * 3 + 1];
-			worldPos.z = transform.verticeList[vericeIndex * 3 + 2];
-			worldPos = GetScreenPos(transform, worldPos);
-
-			screenPoints.push_back(worldPos);
+			BYTE* row = mData + (y * mWidth + x1) * mPixelBytes;
+			switch (mFormat)
+			{
+			case DEPTH_FLOAT:
+				for (int i = 0; i < count; i++) ((float*)row)[i] = (float)INT_MAX;
+				break;
+			case DEPTH_FLOAT_REVERSED:
+				memset(row, 0, count * mPixelBytes);
+				break;
+			default:
+				memset(row, 0xff, count * mPixelBytes);
+				break;
+			}
 		}
+	}
 
-		//计算面片的UV.
-		for (int i = 0; i < screenPoints.size()/4; i++)
-		{
-			Vector4 pt1 = screenPoints[i*4];
-			Vector4 pt2 = screenPoints[i*4 + 1];
-			Vector4 pt3 = screenPoints[i*4 + 2];
-			Vector4 pt4 = screenPoints[i*4 + 3];
+	bool Reversed() { return DEPTH_FLOAT_REVERSED == mFormat; }
 
-			pt1.u = 0 / pt1.w; pt1.v = 0 / pt1.w;
-			pt2.u = 1 / pt2.w; pt2.v = 0 / pt2.w;
-			pt3.u = 1 / pt3.w; pt3.v = 1 / pt3.w;
-			pt4.u = 0 / pt4.w; pt4.v = 1 / pt4.w;
+	//Depth test at index, writes z when passed and write is set.
+	bool Test(int index, float z, DEPTH_FUNC func, bool write = true)
+	{
+		if (DEPTH_NONE == func) return true;
 
-			trianglePoints.push_back(pt1);
-			trianglePoints.push_back(pt2);
-			trianglePoints.push_back(pt3);
-			trianglePoints.push_back(pt1);
-			trianglePoints.push_back(pt3);
-			trianglePoints.push_back(pt4);
+		switch (mFormat)
+		{
+		case DEPTH_FLOAT:
+		{
+			float* buf = (float*)mData;
+			if (!Pass(z, buf[index], func)) return false;
+			if (write) buf[index] = z;
+			return true;
 		}
-
-		switch (transform.type)
+		case DEPTH_FLOAT_REVERSED:
 		{
-		case DRAW_POINT:
-			for (int i = 0; i < trianglePoints.size(); i++)
-			{
-				if (trianglePoints[i].w < 0) continue;;
-				SetPiexel(trianglePoints[i].x, trianglePoints[i].y, trianglePoints[i].z, Color::Black());
-			}
-			break;
-		case DRAW_LINE:
-			for (int i = 0; i < trianglePoints.size(); i++)
-			{
-				if (trianglePoints[i].w < 0) continue;
-				if (trianglePoints[(i - 1 + trianglePoints.size()) % trianglePoints.size()].w < 0) continue;
-				DrawLine(trianglePoints[(i - 1 + trianglePoints.size()) % trianglePoints.size()], trianglePoints[i], Color::Black());
-			}
-			break;
-		case DRAW_TRIANGLE:
+			float* buf = (float*)mData;
+			if (!Pass(-z, -buf[index], func)) return false;
+			if (write) buf[index] = z;
+			return true;
+		}
+		case DEPTH_24:
 		{
-			for (int i = 0; i < trianglePoints.size() / 3; i++)
-			{
-				//裁剪只简单做丢弃
-				//if (trianglePoints[i * 3].w < 0) continue;
-				//if (trianglePoints[i * 3 + 1].w < 0) continue;
-				//if (trianglePoints[i * 3 + 2].w < 0) continue;
-
-				DrawArea(trianglePoints[i * 3], trianglePoints[i * 3 + 1], trianglePoints[i * 3 + 2], Color::Black());
-			}
-			break;
+			BYTE* p = mData + index * 3;
+			unsigned int value = Quantize(z, 0xffffff);
+			if (!Pass(value, (unsigned int)(p[0] | (p[1] << 8) | (p[2] << 16)), func)) return false;
+			if (!write) return true;
+			p[0] = value & 0xff;
+			p[1] = (value >> 8) & 0xff;
+			p[2] = (value >> 16) & 0xff;
+			return true;
+		}
+		case DEPTH_16:
+		{
+			unsigned short* buf = (unsigned short*)mData;
+			unsigned short value = (unsigned short)Quantize(z, 0xffff);
+			if (!Pass(value, buf[index], func)) return false;
+			if (write) buf[index] = value;
+			return true;
 		}
 		default:
-			break;
+			return true;
 		}
 	}
 
-	void SetMatrix4(Matrix4& Matrix4)
+	//Stored depth at index, unorm formats are returned in [0, 1].
+	float Read(int index)
 	{
-		mViewProjection = Matrix4;
+		switch (mFormat)
+		{
+		case DEPTH_24:
+		{
+			BYTE* p = mData + index * 3;
+			return (p[0] | (p[1] << 8) | (p[2] << 16)) / (float)0xffffff;
+		}
+		case DEPTH_16:
+			return ((unsigned short*)mData)[index] / (float)0xffff;
+		default:
+			return ((float*)mData)[index];
+		}
 	}
 
-	void Paint()
+private:
+	static unsigned int Quantize(float z, unsigned int maxValue)
 	{
-		SetDIBits(mScreenHDC, mCompatibleBitmap, 0, mHeight, mBuf, mBitmapInfo, DIB_RGB_COLORS);
-		BitBlt(mScreenHDC, -1, -1, mWidth, mHeight, mCompatibleDC, 0, 0, SRCCOPY);
-		memset(mBuf, 45, mWidth * mHeight * PIX_BITS / 8);
-		for (int i = 0; i < mWidth*mHeight; i++) mZBuf[i] = (float)INT_MAX;
+		return (unsigned int)(Math::Clamp(z) * maxValue + 0.5f);
 	}
 
-	void InitTexture(int width, int height)
+	template<typename T>
+	static bool Pass(T value, T stored, DEPTH_FUNC func)
 	{
-		mTextureWidth = width;
-		mTextureHeight = height;
-		mTexture = new unsigned int[width * height];
+		if (DEPTH_LESS == func) return value < stored;
+		if (DEPTH_LEQUAL == func) return value <= stored;
 
-		int i, j;
-		for (j = 0; j < width; j++) {
-			for (i = 0; i < height; i++) {
-				int x = i / 32, y = j / 32;
-				mTexture[j*width + i] = ((x + y) & 1) ? 0xffffff : 0x000000;
-			}
-		}
+		return true;
 	}
+};
 
-	void GetTexturePixel(float u, float v, Color& outColor)
+/* Offscreen target with the back buffer layout, bind it with Device::SetRenderTarget and sample it with
+Device::SetTexture. Without color only depth is rasterized, which is what shadow maps need. */
+class RenderTarget
+{
+public:
+	int width;
+	int height;
+	BYTE* color = NULL;
+	DepthBuffer* depth = NULL;
+	//projection of the last draw into this target, Device::ReadPixels uses it for linear depth.
+	Matrix4 projection;
+public:
+	RenderTarget(int _width, int _height, bool hasColor = true, DEPTH_FORMAT depthFormat = DEPTH_FLOAT)
 	{
-		int xPos = mTextureWidth * u;
-		int yPos = mTextureHeight * v;
-
-		int value = mTexture[yPos * mTextureWidth + xPos];
-		outColor.b = ((value & 0xf000) >> 12)*255/15;
-		outColor.g = ((value & 0x0f00) >> 8) * 255 / 15;;
-		outColor.r = ((value & 0x00f0) >> 4)*255/15;
+		width = _width;
+		height = _height;
+		//one spare byte, pixels are written at offset 1 to 3.
+		if (hasColor) color = new BYTE[width * height * PIX_BITS / 8 + 1];
+		depth = new DepthBuffer(width, height, depthFormat);
+		Clear();
 	}
 
-private:
-	void SetPiexel(int x, int y, float z, const Color& color)
+	~RenderTarget()
 	{
-		if (NULL == mBuf) return;
-		if (x < 0 || y < 0) return;
-		if (y * mWidth * 3 + x * 3 + 3 > mWidth * mHeight * PIX_BITS / 8) return;
+		delete[] color;
+		delete depth;
+	}
 
-		if (z < mZBuf[y * mWidth + x])
-		{
-			mZBuf[y * mWidth + x] = z;
-			mBuf[y * mWidth * 3 + x * 3 + 1] = color.g;
-			mBuf[y * mWidth * 3 + x * 3 + 2] = color.r;
-			mBuf[y * mWidth * 3 + x * 3 + 3] = color.b;
-		}
+	void Clear()
+	{
+		if (color) memset(color, 45, width * height * PIX_BITS / 8 + 1);
+		depth->Clear();
 	}
+};
 
-	void DrawLine(Vector4 start, Vector4 end, Color color, bool readTexture = false)
+/* Decoded BC1 blocks, BLOCK_CACHE_SETS sets of BLOCK_CACHE_WAYS ways with LRU inside a set, so neighbouring
+texels of a scanline decode their block once. Only the raster thread samples textures (deferred lighting reads
+albedo from the G-buffer), the cache is per thread so sampling stays safe anyway.
+Plain data so it can live in thread local storage, texture id 0 is never used so a zeroed cache is empty. */
+class BlockCache
+{
+public:
+	unsigned int textureIds[BLOCK_CACHE_SETS][BLOCK_CACHE_WAYS];
+	int blockIndices[BLOCK_CACHE_SETS][BLOCK_CACHE_WAYS];
+	unsigned int lastUsed[BLOCK_CACHE_SETS][BLOCK_CACHE_WAYS];
+	unsigned int texels[BLOCK_CACHE_SETS][BLOCK_CACHE_WAYS][16];
+	unsigned int clock;
+	unsigned int hitTextureId;
+	int hitBlockIndex;
+	unsigned int* hitTexels;
+};
+
+/* ARGB texels, or BC1 blocks of 4x4 texels in 8 bytes (8 times smaller) that are decoded through a BlockCache.
+BC1 keeps 1 bit alpha, texels with alpha below 128 become transparent black.
+https://docs.microsoft.com/en-us/windows/win32/direct3d10/d3d10-graphics-programming-guide-resources-block-compression#bc1 */
+class Texture
+{
+public:
+	int width;
+	int height;
+	TEXTURE_FORMAT format;
+	unsigned int* texels = NULL;
+	unsigned long long* blocks = NULL;
+	int blocksX;
+	unsigned int id;
+public:
+	Texture(const unsigned int* argb, int _width, int _height, TEXTURE_FORMAT _format = TEXTURE_ARGB)
 	{
-		Color pixelColor = color;
-		if (start.x == end.x && start.y == end.y)
-		{
-			SetPiexel(start.x, start.y, start.z, pixelColor);
-		}
-		else if (start.x == end.x)
+		static unsigned int nextId = 0;
+		id = ++nextId;
+		width = _width;
+		height = _height;
+		format = _format;
+		blocksX = (width + 3) / 4;
+
+		if (TEXTURE_ARGB == format)
 		{
-			for (int y = min(start.y, end.y); y < max(start.y, end.y); y++)
-			{
-				if (readTexture)
-				{
-					float u = Math::Interpolate3D(start.u, start.z, end.u, end.z, (y - start.y) / (end.y - start.y));
-					float v = Math::Interpolate3D(start.v, start.z, end.v, end.z, (y - start.y) / (end.y - start.y));
-					GetTexturePixel(u, v, pixelColor);
-					SetPiexel(start.x, y, Math::Interpolate(start.z, end.z, (y - start.y) / (end.y - start.y)), pixelColor);
-				}
-				
-			}
+			texels = new unsigned int[width * height];
+			memcpy(texels, argb, width * height * sizeof(unsigned int));
+			return;
 		}
-		else if (start.y == end.y)
+
+		int blocksY = (height + 3) / 4;
+		blocks = new unsigned long long[blocksX * blocksY];
+		for (int by = 0; by < blocksY; by++)
 		{
-			for (int x = min(start.x, end.x); x < max(start.x, end.x); x++)
+			for (int bx = 0; bx < blocksX; bx++)
 			{
-				if (readTexture)
+				unsigned int blockTexels[16];
+				for (int i = 0; i < 16; i++)
 				{
-					float u = Math::Interpolate3D(start.u, start.z, end.u, end.z, (x - start.x) / (end.x - start.x));
-					float v = Math::Interpolate3D(start.v, start.z, end.v, end.z, (x - start.x) / (end.x - start.x));
-					GetTexturePixel(u, v, pixelColor);
+					int x = min(bx * 4 + i % 4, width - 1), y = min(by * 4 + i / 4, height - 1);
+					blockTexels[i] = argb[y * width + x];
 				}
-				SetPiexel(x, start.y, Math::Interpolate(start.z, end.z, (x - start.x) / (end.x - start.x)), pixelColor);
+				blocks[by * blocksX + bx] = EncodeBlock(blockTexels);
 			}
 		}
 	}
 
-	void DrawArea(Vector4 point1, Vector4 point2, Vector4 point3, Color color)
+	~Texture()
 	{
-		int minX = min(point1.x, min(point2.x, point3.x)) - 0.5f;
-		int maxX = max(point1.x, max(point2.x, point3.x)) + 0.5f;
-		Vector4 startScan, endScan;
+		delete[] texels;
+		delete[] blocks;
+	}
 
-		for (int i = minX; i < maxX; i++)
+	unsigned int GetTexel(int x, int y)
+	{
+		if (TEXTURE_ARGB == format) return texels[y * width + x];
+
+		return DecodedBlock((y >> 2) * blocksX + (x >> 2))[(y & 3) * 4 + (x & 3)];
+	}
+
+private:
+	const unsigned int* DecodedBlock(int blockIndex)
+	{
+		static THREAD_LOCAL BlockCache cache;
+		if (cache.hitTextureId == id && cache.hitBlockIndex == blockIndex) return cache.hitTexels;
+
+		int set = (blockIndex * 2654435761u) >> 28 & (BLOCK_CACHE_SETS - 1);
+		int way = -1, oldest = 0;
+		for (int i = 0; i < BLOCK_CACHE_WAYS; i++)
+		{
+			if (cache.textureIds[set][i] == id && cache.blockIndices[set][i] == blockIndex) { way = i; break; }
+			if (cache.lastUsed[set][i] < cache.lastUsed[set][oldest]) oldest = i;
+		}
+		if (way < 0)
+		{
+			way = oldest;
+			DecodeBlock(blocks[blockIndex], cache.texels[set][way]);
+			cache.textureIds[set][way] = id;
+			cache.blockIndices[set][way] = blockIndex;
+		}
+
+		cache.lastUsed[set][way] = ++cache.clock;
+		cache.hitTextureId = id;
+		cache.hitBlockIndex = blockIndex;
+		cache.hitTexels = cache.texels[set][way];
+
+		return cache.hitTexels;
+	}
+
+	static unsigned int To565(unsigned int argb)
+	{
+		return ((argb >> 8) & 0xf800) | ((argb >> 5) & 0x07e0) | ((argb >> 3) & 0x001f);
+	}
+
+	static unsigned int From565(unsigned int color)
+	{
+		unsigned int r = (color >> 11) & 0x1f, g = (color >> 5) & 0x3f, b = color & 0x1f;
+
+		return 0xff000000 | (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+	}
+
+	static unsigned int Mix(unsigned int colorA, unsigned int colorB, int weightA, int weightB)
+	{
+		unsigned int ret = 0xff000000;
+		for (int shift = 0; shift < 24; shift += 8)
+		{
+			unsigned int value = (((colorA >> shift) & 0xff) * weightA + ((colorB >> shift) & 0xff) * weightB) / (weightA + weightB);
+			ret |= value << shift;
+		}
+
+		return ret;
+	}
+
+	static void Palette(unsigned int color0, unsigned int color1, unsigned int palette[4])
+	{
+		palette[0] = From565(color0);
+		palette[1] = From565(color1);
+		if (color0 > color1)
+		{
+			palette[2] = Mix(palette[0], palette[1], 2, 1);
+			palette[3] = Mix(palette[0], palette[1], 1, 2);
+		}
+		else
+		{
+			palette[2] = Mix(palette[0], palette[1], 1, 1);
+			palette[3] = 0;
+		}
+	}
+
+	static void DecodeBlock(unsigned long long block, unsigned int out[16])
+	{
+		unsigned int palette[4];
+		Palette(block & 0xffff, (block >> 16) & 0xffff, palette);
+
+		unsigned int indices = (unsigned int)(block >> 32);
+		for (int i = 0; i < 16; i++) out[i] = palette[(indices >> (i * 2)) & 3];
+	}
+
+	//Endpoints are the corners of the color bounding box, every texel takes the nearest palette entry.
+	static unsigned long long EncodeBlock(const unsigned int texels[16])
+	{
+		unsigned int minColor = 0xffffff, maxColor = 0;
+		bool hasAlpha = false;
+		for (int i = 0; i < 16; i++)
+		{
+			if ((texels[i] >> 24) < 128) { hasAlpha = true; continue; }
+			for (int shift = 0; shift < 24; shift += 8)
+			{
+				unsigned int value = (texels[i] >> shift) & 0xff;
+				if (value < ((minColor >> shift) & 0xff)) minColor = (minColor & ~(0xffu << shift)) | (value << shift);
+				if (value > ((maxColor >> shift) & 0xff)) maxColor = (maxColor & ~(0xffu << shift)) | (value << shift);
+			}
+		}
+
+		unsigned int color0 = To565(maxColor), color1 = To565(minColor);
+		//4 color mode needs color0 > color1, 3 color mode with transparency needs color0 <= color1.
+		if (hasAlpha == (color0 > color1))
+		{
+			unsigned int temp = color0; color0 = color1; color1 = temp;
+		}
+
+		unsigned int palette[4];
+		Palette(color0, color1, palette);
+		int paletteSize = (color0 > color1) ? 4 : 3;
+		unsigned int indices = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			int best = 3;
+			if (!hasAlpha || (texels[i] >> 24) >= 128)
+			{
+				int bestDistance = INT_MAX;
+				for (int j = 0; j < paletteSize; j++)
+				{
+					int distance = 0;
+					for (int shift = 0; shift < 24; shift += 8)
+					{
+						int delta = (int)((texels[i] >> shift) & 0xff) - (int)((palette[j] >> shift) & 0xff);
+						distance += delta * delta;
+					}
+					if (distance < bestDistance) { bestDistance = distance; best = j; }
+				}
+			}
+			indices |= best << (i * 2);
+		}
+
+		return color0 | (color1 << 16) | ((unsigned long long)indices << 32);
+	}
+};
+
+//Directional lights shine along direction, point lights fade out to nothing at range.
+class Light
+{
+public:
+	LIGHT_TYPE type = LIGHT_DIRECTIONAL;
+	Vector4 position;
+	Vector4 direction = Vector4(0, -1, 0);
+	Color color = Color(255, 255, 255);
+	float intensity = 1;
+	float range = 10;
+	//depth only target rendered from the light, shadowMatrix is that pass's view * projection.
+	RenderTarget* shadowMap = NULL;
+	Matrix4 shadowMatrix;
+	float shadowBias = 0.002f;
+};
+
+/* Surface of one pixel for deferred shading, depth stays in the DepthBuffer.
+The normal is octahedral encoded into two snorm16, uv is unorm16 and albedo alpha 0 marks an empty pixel.
+http://jcgt.org/published/0003/02/01/ */
+class GBufferTexel
+{
+public:
+	unsigned int albedo;
+	short normalX, normalY;
+	unsigned short u, v;
+public:
+	void SetNormal(const Vector4& normal)
+	{
+		float length = fabs(normal.x) + fabs(normal.y) + fabs(normal.z);
+		float x = normal.x / length, y = normal.y / length;
+		if (normal.z < 0)
+		{
+			float foldX = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+			y = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+			x = foldX;
+		}
+		normalX = (short)(x * 32767);
+		normalY = (short)(y * 32767);
+	}
+
+	Vector4 GetNormal()
+	{
+		float x = normalX / 32767.0f, y = normalY / 32767.0f;
+		float z = 1 - fabs(x) - fabs(y);
+		if (z < 0)
+		{
+			float foldX = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+			y = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+			x = foldX;
+		}
+
+		return Vector4(x, y, z).Normalize();
+	}
+};
+
+/* Runs func(i) for i in [0, count) on threads started once, the calling thread works too.
+Indices are handed out one at a time, For returns when every worker is done with the job. */
+class WorkerPool
+{
+private:
+	std::vector<std::thread> mThreads;
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mDone;
+	std::function<void(int)> mJob;
+	std::atomic<int> mNext;
+	int mCount = 0;
+	int mBusy = 0;
+	int mGeneration = 0;
+	bool mQuit = false;
+
+public:
+	WorkerPool() : mNext(0)
+	{
+		int threadCount = max(1, (int)std::thread::hardware_concurrency()) - 1;
+		for (int t = 0; t < threadCount; t++) mThreads.push_back(std::thread(&WorkerPool::Work, this));
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mQuit = true;
+		}
+		mWake.notify_all();
+		for (int t = 0; t < mThreads.size(); t++) mThreads[t].join();
+	}
+
+	void For(int count, const std::function<void(int)>& func)
+	{
+		if (mThreads.empty() || count <= 1)
+		{
+			for (int i = 0; i < count; i++) func(i);
+			return;
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mJob = func;
+			mCount = count;
+			mNext = 0;
+			mBusy = mThreads.size();
+			mGeneration++;
+		}
+		mWake.notify_all();
+		Run();
+
+		std::unique_lock<std::mutex> lock(mMutex);
+		mDone.wait(lock, [this]() { return 0 == mBusy; });
+		mJob = nullptr;
+	}
+
+private:
+	void Run()
+	{
+		for (int i = mNext++; i < mCount; i = mNext++) mJob(i);
+	}
+
+	void Work()
+	{
+		int generation = 0;
+		std::unique_lock<std::mutex> lock(mMutex);
+		while (true)
+		{
+			mWake.wait(lock, [&]() { return mQuit || generation != mGeneration; });
+			if (mQuit) return;
+
+			generation = mGeneration;
+			lock.unlock();
+			Run();
+			lock.lock();
+			if (0 == --mBusy) mDone.notify_one();
+		}
+	}
+};
+
+//Pixels of one span waiting to be blended, channels are kept apart so they load straight into SSE registers.
+class PixelSpan
+{
+public:
+	std::vector<int> offsets;
+	std::vector<float> r, g, b, a;
+	std::vector<float> dstR, dstG, dstB;
+public:
+	void Push(int offset, const Color& color)
+	{
+		offsets.push_back(offset);
+		r.push_back(color.r);
+		g.push_back(color.g);
+		b.push_back(color.b);
+		a.push_back(color.a);
+	}
+
+	void Clear()
+	{
+		offsets.clear();
+		r.clear(); g.clear(); b.clear(); a.clear();
+	}
+};
+
+/* Triangle held back for the transparency pass, key is the mean view depth used for sorting.
+Blended lines and points are held back the same way, using the first 2 or 1 points and size as the line width or point size. */
+class TransparentTriangle
+{
+public:
+	DRAW_TYPE type = DRAW_TRIANGLE;
+	int size = 1;
+	Vector4 points[3];
+	Rect bounds;
+	float key;
+	BLEND_MODE blendMode;
+	int alpha;
+	DEPTH_FUNC depthFunc;
+
+	static bool FartherFirst(const TransparentTriangle* triA, const TransparentTriangle* triB)
+	{
+		return triA->key > triB->key;
+	}
+};
+
+//One layer of the k-buffer, color is packed as ARGB.
+class Fragment
+{
+public:
+	float depth;
+	unsigned int color;
+	BYTE blendMode;
+};
+
+//Screen bounds and matrix an object was drawn with, used by the incremental redraw.
+class DirtyRecord
+{
+public:
+	Rect bounds;
+	Matrix4 worldViewProjection;
+	unsigned int stateHash;
+	int frame = -1;
+};
+
+class Device
+{
+private:
+	int mWidth;
+	int mHeight;
+	BYTE* mBuf = NULL;
+	DepthBuffer* mZBuf = NULL;
+	DEPTH_FUNC mDepthFunc = DEPTH_LESS;
+	Texture* mTexture = NULL;
+	BITMAPINFO* mBitmapInfo = NULL;
+	HDC mScreenHDC;
+	HDC mCompatibleDC;
+	HBITMAP mOldBitmap;
+	HBITMAP mCompatibleBitmap;
+	Matrix4 mViewProjection;
+	Matrix4 mProjection;
+	Rect mScissor;
+	bool mIncremental = false;
+	bool mFullRedraw = true;
+	int mFrame = 0;
+	Rect mDirtyRect;
+	std::map<Transform*, DirtyRecord> mDirtyRecords;
+	std::vector<Transform*> mFrameObjects;
+	BLEND_MODE mBlendMode = BLEND_NONE;
+	int mAlpha = 255;
+	TRANSPARENCY_MODE mTransparencyMode = TRANSPARENCY_SORTED;
+	std::vector<TransparentTriangle> mTransparentTriangles;
+	PixelSpan mSpans[BLEND_MULTIPLY + 1];
+	Fragment* mFragments = NULL;
+	BYTE* mFragmentCounts = NULL;
+	bool mCollectFragments = false;
+	bool mDeferred = false;
+	GBufferTexel* mGBuffer = NULL;
+	std::vector<Light> mLights;
+	Color mAmbient = Color(50, 50, 50);
+	Vector4 mEyePosition;
+	Vector4 mNormal;
+	RenderTarget* mRenderTarget = NULL;
+	RenderTarget* mTextureTarget = NULL;
+	BYTE* mBackBuf = NULL;
+	DepthBuffer* mBackZBuf = NULL;
+	Matrix4 mBackProjection;
+	int mBackWidth;
+	int mBackHeight;
+	std::vector<TransparentTriangle> mBackBufferTriangles;
+	WorkerPool mWorkers;
+	PIXEL_FORMAT mReadbackFormat;
+	void* mReadback = NULL;
+	int mReadbackPitch;
+
+public:
+	Device(HWND hwnd, int width = SCREEN_WIDTH, int height = SCREEN_HEIGHT)
+	{
+		mWidth = width;
+		mHeight = height;
+		//one spare byte like RenderTarget, pixels are written at offset 1 to 3.
+		mBuf = new BYTE[mWidth * mHeight * PIX_BITS / 8 + 1];
+		memset(mBuf, 45, mWidth * mHeight * PIX_BITS / 8 + 1);
+		mZBuf = new DepthBuffer(mWidth, mHeight);
+		mScissor = Rect(0, 0, mWidth, mHeight);
+
+		mBitmapInfo = new BITMAPINFO();
+		ZeroMemory(mBitmapInfo, sizeof(BITMAPINFO));
+
+		mBitmapInfo->bmiHeader.biBitCount = PIX_BITS;
+		mBitmapInfo->bmiHeader.biCompression = BI_RGB;
+		mBitmapInfo->bmiHeader.biHeight = -mHeight;
+		mBitmapInfo->bmiHeader.biPlanes = 1;
+		mBitmapInfo->bmiHeader.biSizeImage = 0;
+		mBitmapInfo->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		mBitmapInfo->bmiHeader.biWidth = mWidth;
+
+		mScreenHDC = GetDC(hwnd);
+		mCompatibleDC = CreateCompatibleDC(mScreenHDC);
+		mCompatibleBitmap = CreateCompatibleBitmap(mScreenHDC, mWidth, mHeight);
+		mOldBitmap = (HBITMAP)SelectObject(mCompatibleDC, mCompatibleBitmap);
+	}
+
+	/* 
+	https://stackoverflow.com/questions/3792481/how-to-get-screen-coordinates-from-a-3d-point-opengl
+	https://stackoverflow.com/questions/724219/how-to-convert-a-3d-point-into-2d-perspective-projection/866749#866749 */
+	Vector4 GetScreenPos(Transform& transform, Vector4& worldPos)
+	{
+		Vector4 pos = worldPos * transform.WorldViewProjection();
+		bool inClipping = CheckInclipping(pos);
+		pos.x = (pos.x /pos.w + 1)*mWidth/2;
+		pos.y = (1 - pos.y / pos.w)*mHeight/2;
+		pos.z = pos.z / pos.w;
+
+		return pos;
+	}
+
+	bool CheckInclipping(Vector4 pos)
+	{
+		if (pos.z < 0) return false;
+		if (pos.z > pos.w) return false;
+		if (pos.x < -pos.w) return false;
+		if (pos.x > pos.w) return false;
+		if (pos.y < -pos.w) return false;
+		if (pos.y > pos.w) return false;
+
+		return true;
+	}
+
+	//In incremental mode the draw is only recorded here, and rasterized by Paint inside the dirty rectangle.
+	void DrawArrays(Transform& transform)
+	{
+		if (mIncremental && NULL == mRenderTarget)
+		{
+			TrackDirty(transform);
+			return;
+		}
+
+		DrawTransform(transform);
+	}
+
+	void DrawTransform(Transform& transform)
+	{
+		std::vector<Vector4> screenPoints;
+		std::vector<Vector4> trianglePoints;
+		mDepthFunc = transform.depthFunc;
+		mProjection = transform.projectionMatrix;
+		for (int i = 0; i < transform.indiceList.size(); i++)
+		{
+			Vector4 worldPos;
+			int vericeIndex = transform.indiceList[i];
+
+			worldPos.x = transform.verticeList[vericeIndex * 3];
+			worldPos.y = transform.verticeList[vericeIndex * 3 + 1];
+			worldPos.z = transform.verticeList[vericeIndex * 3 + 2];
+			worldPos = GetScreenPos(transform, worldPos);
+
+			screenPoints.push_back(worldPos);
+		}
+
+		//G-buffer positions are reconstructed with the inverse view projection, the normal is per face.
+		std::vector<Vector4> faceNormals;
+		if (IsDeferred())
+		{
+			Matrix4 inverseView = transform.viewMatrix.Inverse();
+			mViewProjection = transform.viewMatrix * transform.projectionMatrix;
+			mEyePosition = Vector4(inverseView.mm[3][0], inverseView.mm[3][1], inverseView.mm[3][2]);
+		}
+
+		//计算面片的UV.
+		for (int i = 0; i < screenPoints.size()/4; i++)
+		{
+			if (IsDeferred())
+			{
+				Vector4 facePoints[3];
+				for (int j = 0; j < 3; j++)
+				{
+					int vericeIndex = transform.indiceList[i * 4 + j];
+					facePoints[j] = Vector4(transform.verticeList[vericeIndex * 3], transform.verticeList[vericeIndex * 3 + 1], transform.verticeList[vericeIndex * 3 + 2]);
+					facePoints[j] = facePoints[j] * transform.worldMatrix;
+				}
+				Vector4 edge1 = facePoints[1] - facePoints[0];
+				Vector4 edge2 = facePoints[2] - facePoints[0];
+				faceNormals.push_back(Vector4::Cross(edge1, edge2).Normalize());
+			}
+
+			Vector4 pt1 = screenPoints[i*4];
+			Vector4 pt2 = screenPoints[i*4 + 1];
+			Vector4 pt3 = screenPoints[i*4 + 2];
+			Vector4 pt4 = screenPoints[i*4 + 3];
+
+			pt1.u = 0 / pt1.w; pt1.v = 0 / pt1.w;
+			pt2.u = 1 / pt2.w; pt2.v = 0 / pt2.w;
+			pt3.u = 1 / pt3.w; pt3.v = 1 / pt3.w;
+			pt4.u = 0 / pt4.w; pt4.v = 1 / pt4.w;
+
+			trianglePoints.push_back(pt1);
+			trianglePoints.push_back(pt2);
+			trianglePoints.push_back(pt3);
+			trianglePoints.push_back(pt1);
+			trianglePoints.push_back(pt3);
+			trianglePoints.push_back(pt4);
+		}
+
+		switch (transform.type)
+		{
+		case DRAW_POINT:
+		{
+			std::vector<Vector4> points;
+			for (int i = 0; i < screenPoints.size(); i++)
+			{
+				if (screenPoints[i].w < 0) continue;
+				if (BLEND_NONE == transform.blendMode) points.push_back(screenPoints[i]);
+				else if (mBuf) QueueTransparent(transform, DRAW_POINT, &screenPoints[i], 1, transform.pointSize);
+			}
+			DrawPoints(points, transform.pointSize, Color::Black());
+			break;
+		}
+		case DRAW_LINE:
+		{
+			//the 4 outer edges of each quad and its pt1-pt3 diagonal, so the shared edge is not drawn twice.
+			const int edges[5][2] = { { 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 }, { 0, 2 } };
+			for (int i = 0; i < screenPoints.size() / 4; i++)
+			{
+				for (int j = 0; j < 5; j++)
+				{
+					Vector4& start = screenPoints[i * 4 + edges[j][0]];
+					Vector4& end = screenPoints[i * 4 + edges[j][1]];
+					if (start.w < 0 || end.w < 0) continue;
+					if (BLEND_NONE == transform.blendMode)
+					{
+						DrawSegment(start, end, Color::Black(), transform.lineWidth);
+					}
+					else if (mBuf)
+					{
+						Vector4 segment[2] = { start, end };
+						QueueTransparent(transform, DRAW_LINE, segment, 2, transform.lineWidth);
+					}
+				}
+			}
+			break;
+		}
+		case DRAW_TRIANGLE:
+		{
+			for (int i = 0; i < trianglePoints.size() / 3; i++)
+			{
+				//裁剪只简单做丢弃
+				//if (trianglePoints[i * 3].w < 0) continue;
+				//if (trianglePoints[i * 3 + 1].w < 0) continue;
+				//if (trianglePoints[i * 3 + 2].w < 0) continue;
+
+				if (NULL == mBuf)
+				{
+					if (BLEND_NONE == transform.blendMode)
+						DrawDepthArea(trianglePoints[i * 3], trianglePoints[i * 3 + 1], trianglePoints[i * 3 + 2]);
+					continue;
+				}
+
+				if (BLEND_NONE != transform.blendMode)
+				{
+					QueueTransparent(transform, DRAW_TRIANGLE, &trianglePoints[i * 3], 3);
+					continue;
+				}
+
+				if (IsDeferred()) mNormal = faceNormals[i / 2];
+				DrawArea(trianglePoints[i * 3], trianglePoints[i * 3 + 1], trianglePoints[i * 3 + 2], Color::Black());
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void SetMatrix4(Matrix4& Matrix4)
+	{
+		mViewProjection = Matrix4;
+	}
+
+	void Paint()
+	{
+		SetRenderTarget(NULL);
+		if (mIncremental)
+		{
+			PaintDirty();
+			return;
+		}
+
+		if (mDeferred) LightPass();
+		ResolveTransparency();
+		if (mReadback) ReadPixels(mReadbackFormat, mReadback, mReadbackPitch);
+		SetDIBits(mScreenHDC, mCompatibleBitmap, 0, mHeight, mBuf, mBitmapInfo, DIB_RGB_COLORS);
+		BitBlt(mScreenHDC, -1, -1, mWidth, mHeight, mCompatibleDC, 0, 0, SRCCOPY);
+		memset(mBuf, 45, mWidth * mHeight * PIX_BITS / 8 + 1);
+		mZBuf->Clear();
+		if (mGBuffer) memset(mGBuffer, 0, mWidth * mHeight * sizeof(GBufferTexel));
+	}
+
+	/* Deferred mode: opaque triangles only fill the G-buffer, and Paint lights every covered pixel once,
+	before the transparency pass. Lines and points stay forward shaded. */
+	void SetDeferred(bool deferred)
+	{
+		mDeferred = deferred;
+		if (mDeferred && NULL == mGBuffer)
+		{
+			//sized for the back buffer even while a target is bound.
+			int count = mRenderTarget ? mBackWidth * mBackHeight : mWidth * mHeight;
+			mGBuffer = new GBufferTexel[count];
+			memset(mGBuffer, 0, count * sizeof(GBufferTexel));
+		}
+		Invalidate();
+	}
+
+	/* Draw into target instead of the back buffer, NULL binds the back buffer again. Pending transparent
+	triangles of the target being left are resolved into it, deferred and incremental rendering only
+	apply to the back buffer. Redrawing a sampled target does not dirty the incremental frame, call Invalidate. */
+	void SetRenderTarget(RenderTarget* target)
+	{
+		if (target == mRenderTarget) return;
+
+		if (NULL != mRenderTarget)
+		{
+			ResolveTransparency();
+			mRenderTarget->projection = mProjection;
+		}
+		else
+		{
+			mBackBuf = mBuf;
+			mBackZBuf = mZBuf;
+			mBackProjection = mProjection;
+			mBackWidth = mWidth;
+			mBackHeight = mHeight;
+		}
+		if (NULL == mRenderTarget || NULL == target) mTransparentTriangles.swap(mBackBufferTriangles);
+
+		mRenderTarget = target;
+		mBuf = target ? target->color : mBackBuf;
+		mZBuf = target ? target->depth : mBackZBuf;
+		mProjection = target ? target->projection : mBackProjection;
+		mWidth = target ? target->width : mBackWidth;
+		mHeight = target ? target->height : mBackHeight;
+		mScissor = Rect(0, 0, mWidth, mHeight);
+	}
+
+	//Sample target instead of the texture, NULL goes back to the texture. Depth only targets read as gray.
+	void SetTexture(RenderTarget* target)
+	{
+		mTextureTarget = target;
+		Invalidate();
+	}
+
+	//Lighting changes relight the whole incremental frame.
+	void AddLight(const Light& light)
+	{
+		mLights.push_back(light);
+		Invalidate();
+	}
+
+	void ClearLights()
+	{
+		mLights.clear();
+		Invalidate();
+	}
+
+	void SetAmbient(const Color& ambient)
+	{
+		mAmbient = ambient;
+		Invalidate();
+	}
+
+	/* Only redraw the union of the old and new bounds of every object that moved, static scenes cost nothing.
+	Buffers are kept between frames, so everything the window shows must be submitted each frame. */
+	void SetIncremental(bool incremental)
+	{
+		mIncremental = incremental;
+		mDirtyRecords.clear();
+		mFrameObjects.clear();
+		Invalidate();
+	}
+
+	/* Transparent triangles, lines and points are drawn after all opaque ones, either sorted back to front per tile,
+	or in any order into a k-buffer of KBUFFER_LAYERS fragments per pixel that is sorted when resolved.
+	When a pixel overflows the k-buffer its farthest fragment is blended straight away. */
+	void SetTransparencyMode(TRANSPARENCY_MODE mode)
+	{
+		mTransparencyMode = mode;
+		if (TRANSPARENCY_KBUFFER == mode && NULL == mFragments)
+		{
+			int count = mRenderTarget ? mBackWidth * mBackHeight : mWidth * mHeight;
+			mFragments = new Fragment[count * KBUFFER_LAYERS];
+			mFragmentCounts = new BYTE[count];
+			memset(mFragmentCounts, 0, count);
+		}
+		Invalidate();
+	}
+
+	//Force the next incremental Paint to redraw the whole frame, e.g. on WM_PAINT.
+	void Invalidate()
+	{
+		mFullRedraw = true;
+	}
+
+	//Depth format of the back buffer, DEPTH_FLOAT_REVERSED needs the projection from Camera::PerspectiveReversed.
+	void SetDepthFormat(DEPTH_FORMAT format)
+	{
+		DepthBuffer*& backZBuf = mRenderTarget ? mBackZBuf : mZBuf;
+		if (format == backZBuf->Format()) return;
+
+		delete backZBuf;
+		backZBuf = new DepthBuffer(mRenderTarget ? mBackWidth : mWidth, mRenderTarget ? mBackHeight : mHeight, format);
+		Invalidate();
+	}
+
+	/* Paint converts every finished frame into dst before the back buffer is cleared, NULL stops it.
+	In incremental mode only the rows of the dirty rectangle are converted and a static frame converts nothing,
+	so dst has to be kept from frame to frame. Setting a readback redraws the next frame fully to fill dst. */
+	void SetReadback(PIXEL_FORMAT format, void* dst, int pitch = 0)
+	{
+		mReadbackFormat = format;
+		mReadback = dst;
+		mReadbackPitch = pitch;
+		Invalidate();
+	}
+
+	/* Convert the bound color or depth buffer into dst, one row per task. pitch is the byte stride of a dst row,
+	0 packs rows. PIXEL_YUV420 writes I420: the Y plane, then U and V planes of half size with half the pitch.
+	PIXEL_DEPTH_LINEAR writes view space z as float, using the projection last drawn into the bound buffer. */
+	void ReadPixels(PIXEL_FORMAT format, void* dst, int pitch = 0)
+	{
+		ReadRows(format, dst, pitch, 0, mHeight);
+	}
+
+	void InitTexture(int width, int height, TEXTURE_FORMAT format = TEXTURE_ARGB)
+	{
+		unsigned int* texels = new unsigned int[width * height];
+
+		int i, j;
+		for (j = 0; j < width; j++) {
+			for (i = 0; i < height; i++) {
+				int x = i / 32, y = j / 32;
+				texels[j*width + i] = ((x + y) & 1) ? 0xffffffff : 0xff000000;
+			}
+		}
+
+		LoadTexture(texels, width, height, format);
+		delete[] texels;
+	}
+
+	//texels are ARGB, TEXTURE_BC1 compresses them on load.
+	void LoadTexture(const unsigned int* texels, int width, int height, TEXTURE_FORMAT format = TEXTURE_ARGB)
+	{
+		delete mTexture;
+		mTexture = new Texture(texels, width, height, format);
+		Invalidate();
+	}
+
+	void GetTexturePixel(float u, float v, Color& outColor)
+	{
+		if (mTextureTarget)
+		{
+			GetTargetPixel(u, v, outColor);
+			return;
+		}
+
+		int xPos = min((int)(mTexture->width * u), mTexture->width - 1);
+		int yPos = min((int)(mTexture->height * v), mTexture->height - 1);
+
+		unsigned int value = mTexture->GetTexel(xPos, yPos);
+		outColor.a = (value >> 24) & 0xff;
+		outColor.r = (value >> 16) & 0xff;
+		outColor.g = (value >> 8) & 0xff;
+		outColor.b = value & 0xff;
+	}
+
+private:
+	//Screen bounds of all vertices, 2 pixels wider to cover rounding, the whole screen if any vertex is behind the camera.
+	Rect ScreenBounds(Transform& transform)
+	{
+		Rect viewport(0, 0, mWidth, mHeight);
+		Matrix4 worldViewProjection = transform.WorldViewProjection();
+		float minX = mWidth, minY = mHeight, maxX = 0, maxY = 0;
+
+		for (int i = 0; i < transform.verticeList.size() / 3; i++)
+		{
+			Vector4 pos(transform.verticeList[i * 3], transform.verticeList[i * 3 + 1], transform.verticeList[i * 3 + 2]);
+			pos = pos * worldViewProjection;
+			if (pos.w <= 0) return viewport;
+
+			float x = (pos.x / pos.w + 1)*mWidth / 2;
+			float y = (1 - pos.y / pos.w)*mHeight / 2;
+			minX = min(minX, x); maxX = max(maxX, x);
+			minY = min(minY, y); maxY = max(maxY, y);
+		}
+
+		float margin = 2 + max(transform.lineWidth, transform.pointSize) / 2;
+		return Rect(floor(minX) - margin, floor(minY) - margin, ceil(maxX) + margin, ceil(maxY) + margin).Intersect(viewport);
+	}
+
+	void TrackDirty(Transform& transform)
+	{
+		DirtyRecord& record = mDirtyRecords[&transform];
+		Matrix4 worldViewProjection = transform.WorldViewProjection();
+		Rect bounds = ScreenBounds(transform);
+		unsigned int stateHash = transform.StateHash();
+
+		if (record.frame < 0 || record.stateHash != stateHash ||
+			memcmp(record.worldViewProjection.mm, worldViewProjection.mm, sizeof(worldViewProjection.mm)) != 0)
+			mDirtyRect = mDirtyRect.Union(record.bounds).Union(bounds);
+
+		record.bounds = bounds;
+		record.worldViewProjection = worldViewProjection;
+		record.stateHash = stateHash;
+		record.frame = mFrame;
+		mFrameObjects.push_back(&transform);
+	}
+
+	void PaintDirty()
+	{
+		Rect viewport(0, 0, mWidth, mHeight);
+
+		//objects not submitted this frame leave their old bounds behind.
+		for (std::map<Transform*, DirtyRecord>::iterator it = mDirtyRecords.begin(); it != mDirtyRecords.end();)
+		{
+			if (it->second.frame == mFrame) { ++it; continue; }
+			mDirtyRect = mDirtyRect.Union(it->second.bounds);
+			it = mDirtyRecords.erase(it);
+		}
+
+		Rect dirty = mFullRedraw ? viewport : mDirtyRect.Intersect(viewport);
+		if (!dirty.IsEmpty())
+		{
+			ClearRect(dirty);
+			mScissor = dirty;
+			for (int i = 0; i < mFrameObjects.size(); i++)
+			{
+				if (!mDirtyRecords[mFrameObjects[i]].bounds.Intersect(dirty).IsEmpty())
+					DrawTransform(*mFrameObjects[i]);
+			}
+			if (mDeferred) LightPass();
+			ResolveTransparency();
+			mScissor = viewport;
+			PresentRect(dirty);
+			if (mReadback) ReadRows(mReadbackFormat, mReadback, mReadbackPitch, dirty._y1, dirty._y2);
+		}
+
+		mFrameObjects.clear();
+		mDirtyRect = Rect();
+		mFullRedraw = false;
+		mFrame++;
+	}
+
+	void ClearRect(const Rect& rect)
+	{
+		int x1 = rect._x1, y1 = rect._y1, x2 = rect._x2, y2 = rect._y2;
+		int size = mWidth * mHeight * PIX_BITS / 8 + 1;
+
+		//pixels are written at offset 1 to 3, see SetPiexel.
+		for (int y = y1; y < y2; y++)
+		{
+			int start = (y * mWidth + x1) * 3 + 1;
+			memset(mBuf + start, 45, min((x2 - x1) * 3, size - start));
+		}
+		mZBuf->Clear(x1, y1, x2, y2);
+		if (mGBuffer)
+		{
+			for (int y = y1; y < y2; y++) memset(mGBuffer + y * mWidth + x1, 0, (x2 - x1) * sizeof(GBufferTexel));
+		}
+	}
+
+	//Light the G-buffer inside the scissor rectangle, one LIGHT_TILE_SIZE tile per task.
+	void LightPass()
+	{
+		int x1 = mScissor._x1, y1 = mScissor._y1, x2 = mScissor._x2, y2 = mScissor._y2;
+		int tilesX = (x2 - x1 + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		int tilesY = (y2 - y1 + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+		Matrix4 inverseViewProjection = mViewProjection.Inverse();
+
+		mWorkers.For(tilesX * tilesY, [&](int tile)
+		{
+			int tileX = x1 + tile % tilesX * LIGHT_TILE_SIZE;
+			int tileY = y1 + tile / tilesX * LIGHT_TILE_SIZE;
+			LightTile(Rect(tileX, tileY, min(tileX + LIGHT_TILE_SIZE, x2), min(tileY + LIGHT_TILE_SIZE, y2)), inverseViewProjection);
+		});
+	}
+
+	/* Rebuild the world position of every covered pixel, cull point lights against the bounding box
+	of those positions, then shade the pixels with the lights left. Lambert with two sided normals. */
+	void LightTile(const Rect& tile, Matrix4& inverseViewProjection)
+	{
+		int x1 = tile._x1, y1 = tile._y1, x2 = tile._x2, y2 = tile._y2;
+		Vector4 positions[LIGHT_TILE_SIZE * LIGHT_TILE_SIZE];
+		Vector4 boxMin(FLT_MAX, FLT_MAX, FLT_MAX), boxMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		bool covered = false;
+
+		for (int y = y1; y < y2; y++)
+		{
+			for (int x = x1; x < x2; x++)
+			{
+				int index = y * mWidth + x;
+				if (0 == mGBuffer[index].albedo) continue;
+
+				Vector4 ndc(x * 2.0f / mWidth - 1, 1 - y * 2.0f / mHeight, mZBuf->Read(index));
+				Vector4 pos = ndc * inverseViewProjection;
+				pos = Vector4(pos.x / pos.w, pos.y / pos.w, pos.z / pos.w);
+				positions[(y - y1) * LIGHT_TILE_SIZE + x - x1] = pos;
+
+				boxMin = Vector4(min(boxMin.x, pos.x), min(boxMin.y, pos.y), min(boxMin.z, pos.z));
+				boxMax = Vector4(max(boxMax.x, pos.x), max(boxMax.y, pos.y), max(boxMax.z, pos.z));
+				covered = true;
+			}
+		}
+		if (!covered) return;
+
+		std::vector<Light*> lights;
+		for (int i = 0; i < mLights.size(); i++)
+		{
+			Light& light = mLights[i];
+			if (LIGHT_POINT == light.type)
+			{
+				float dx = max(max(boxMin.x - light.position.x, 0.0f), light.position.x - boxMax.x);
+				float dy = max(max(boxMin.y - light.position.y, 0.0f), light.position.y - boxMax.y);
+				float dz = max(max(boxMin.z - light.position.z, 0.0f), light.position.z - boxMax.z);
+				if (dx * dx + dy * dy + dz * dz > light.range * light.range) continue;
+			}
+			lights.push_back(&light);
+		}
+
+		int size = mWidth * mHeight * PIX_BITS / 8;
+		for (int y = y1; y < y2; y++)
+		{
+			for (int x = x1; x < x2; x++)
+			{
+				int index = y * mWidth + x;
+				GBufferTexel& texel = mGBuffer[index];
+				if (0 == texel.albedo || index * 3 + 3 > size) continue;
+
+				Vector4& pos = positions[(y - y1) * LIGHT_TILE_SIZE + x - x1];
+				Vector4 normal = texel.GetNormal();
+				Vector4 toEye = mEyePosition - pos;
+				if (Vector4::Dot(normal, toEye) < 0) normal = Vector4(-normal.x, -normal.y, -normal.z);
+
+				float r = mAmbient.r / 255.0f, g = mAmbient.g / 255.0f, b = mAmbient.b / 255.0f;
+				for (int i = 0; i < lights.size(); i++)
+				{
+					Light& light = *lights[i];
+					Vector4 toLight(-light.direction.x, -light.direction.y, -light.direction.z);
+					float attenuation = light.intensity;
+					if (light.shadowMap && InShadow(light, pos)) continue;
+					if (LIGHT_POINT == light.type)
+					{
+						toLight = Vector4(light.position.x - pos.x, light.position.y - pos.y, light.position.z - pos.z);
+						float falloff = Math::Clamp(1 - toLight.Length() / light.range);
+						attenuation *= falloff * falloff;
+					}
+
+					float diffuse = max(0.0f, Vector4::Dot(normal, toLight.Normalize())) * attenuation / 255.0f;
+					r += light.color.r * diffuse;
+					g += light.color.g * diffuse;
+					b += light.color.b * diffuse;
+				}
+
+				mBuf[index * 3 + 1] = (BYTE)min(((texel.albedo >> 8) & 0xff) * g, 255.0f);
+				mBuf[index * 3 + 2] = (BYTE)min(((texel.albedo >> 16) & 0xff) * r, 255.0f);
+				mBuf[index * 3 + 3] = (BYTE)min((texel.albedo & 0xff) * b, 255.0f);
+			}
+		}
+	}
+
+	//Project pos into the light's shadow map and compare against the depth stored there.
+	bool InShadow(Light& light, Vector4& pos)
+	{
+		RenderTarget* shadowMap = light.shadowMap;
+		Vector4 clip = pos * light.shadowMatrix;
+		if (clip.w <= 0) return false;
+
+		int x = (clip.x / clip.w + 1) * shadowMap->width / 2;
+		int y = (1 - clip.y / clip.w) * shadowMap->height / 2;
+		if (x < 0 || y < 0 || x >= shadowMap->width || y >= shadowMap->height) return false;
+
+		float depth = clip.z / clip.w;
+		float stored = shadowMap->depth->Read(y * shadowMap->width + x);
+		if (shadowMap->depth->Reversed()) return depth + light.shadowBias < stored;
+
+		return depth - light.shadowBias > stored;
+	}
+
+	//Copy the band of rows as its own top-down DIB, so only the rectangle goes through GDI.
+	void PresentRect(const Rect& rect)
+	{
+		int x1 = rect._x1, y1 = rect._y1, width = rect._x2 - rect._x1, height = rect._y2 - rect._y1;
+		BITMAPINFO bandInfo = *mBitmapInfo;
+		bandInfo.bmiHeader.biHeight = -height;
+
+		SetDIBitsToDevice(mCompatibleDC, x1, y1, width, height, x1, 0, 0, height, mBuf + y1 * mWidth * PIX_BITS / 8, &bandInfo, DIB_RGB_COLORS);
+		BitBlt(mScreenHDC, x1 - 1, y1 - 1, width, height, mCompatibleDC, x1, y1, SRCCOPY);
+	}
+
+	//count is 3 for triangles, 2 for lines and 1 for points, the bounds grow by half of size.
+	void QueueTransparent(Transform& transform, DRAW_TYPE type, const Vector4* points, int count, int size = 1)
+	{
+		TransparentTriangle triangle;
+		triangle.type = type;
+		triangle.size = size;
+		triangle.key = 0;
+		float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+		for (int i = 0; i < count; i++)
+		{
+			triangle.points[i] = points[i];
+			triangle.key += points[i].w / count;
+			minX = min(minX, points[i].x); maxX = max(maxX, points[i].x);
+			minY = min(minY, points[i].y); maxY = max(maxY, points[i].y);
+		}
+		int margin = size / 2 + 1;
+		triangle.bounds = Rect(minX - margin, minY - margin, maxX + margin, maxY + margin);
+		triangle.blendMode = transform.blendMode;
+		triangle.alpha = transform.alpha;
+		triangle.depthFunc = transform.depthFunc;
+		mTransparentTriangles.push_back(triangle);
+	}
+
+	//Draw the queued transparent triangles inside the current scissor rectangle.
+	void ResolveTransparency()
+	{
+		if (mTransparentTriangles.empty()) return;
+
+		Rect scissor = mScissor;
+		//the k-buffer is sized for the back buffer.
+		if (TRANSPARENCY_KBUFFER == mTransparencyMode && NULL == mRenderTarget)
+		{
+			mCollectFragments = true;
+			for (int i = 0; i < mTransparentTriangles.size(); i++)
+				DrawTransparent(mTransparentTriangles[i]);
+			mCollectFragments = false;
+			ResolveFragments();
+		}
+		else
+		{
+			std::vector<TransparentTriangle*> tileList;
+			for (int tileY = (int)scissor._y1 / TILE_SIZE * TILE_SIZE; tileY < scissor._y2; tileY += TILE_SIZE)
+			{
+				for (int tileX = (int)scissor._x1 / TILE_SIZE * TILE_SIZE; tileX < scissor._x2; tileX += TILE_SIZE)
+				{
+					Rect tile = Rect(tileX, tileY, tileX + TILE_SIZE, tileY + TILE_SIZE).Intersect(scissor);
+					tileList.clear();
+					for (int i = 0; i < mTransparentTriangles.size(); i++)
+					{
+						if (!mTransparentTriangles[i].bounds.Intersect(tile).IsEmpty())
+							tileList.push_back(&mTransparentTriangles[i]);
+					}
+					if (tileList.empty()) continue;
+
+					std::sort(tileList.begin(), tileList.end(), TransparentTriangle::FartherFirst);
+					mScissor = tile;
+					for (int i = 0; i < tileList.size(); i++)
+						DrawTransparent(*tileList[i]);
+				}
+			}
+		}
+
+		mScissor = scissor;
+		mBlendMode = BLEND_NONE;
+		mAlpha = 255;
+		mTransparentTriangles.clear();
+	}
+
+	void DrawTransparent(TransparentTriangle& triangle)
+	{
+		mBlendMode = triangle.blendMode;
+		mAlpha = triangle.alpha;
+		mDepthFunc = triangle.depthFunc;
+		switch (triangle.type)
+		{
+		case DRAW_POINT:
+			DrawPoints(std::vector<Vector4>(1, triangle.points[0]), triangle.size, Color::Black());
+			break;
+		case DRAW_LINE:
+			DrawSegment(triangle.points[0], triangle.points[1], Color::Black(), triangle.size);
+			break;
+		default:
+			DrawArea(triangle.points[0], triangle.points[1], triangle.points[2], Color::Black());
+			break;
+		}
+	}
+
+	//Sort each pixel's fragments back to front, then blend them layer by layer so every layer of a row is one span.
+	void ResolveFragments()
+	{
+		int x1 = mScissor._x1, y1 = mScissor._y1, x2 = mScissor._x2, y2 = mScissor._y2;
+
+		for (int y = y1; y < y2; y++)
+		{
+			for (int x = x1; x < x2; x++)
+			{
+				int index = y * mWidth + x;
+				Fragment* fragments = mFragments + index * KBUFFER_LAYERS;
+				for (int i = 1; i < mFragmentCounts[index]; i++)
+				{
+					Fragment fragment = fragments[i];
+					int j = i - 1;
+					for (; j >= 0 && fragments[j].depth < fragment.depth; j--) fragments[j + 1] = fragments[j];
+					fragments[j + 1] = fragment;
+				}
+			}
+
+			for (int layer = 0; layer < KBUFFER_LAYERS; layer++)
+			{
+				for (int x = x1; x < x2; x++)
+				{
+					int index = y * mWidth + x;
+					if (mFragmentCounts[index] <= layer) continue;
+
+					Fragment& fragment = mFragments[index * KBUFFER_LAYERS + layer];
+					mSpans[fragment.blendMode].Push(index * 3, UnpackColor(fragment.color));
+				}
+				FlushSpans();
+			}
+
+			memset(mFragmentCounts + y * mWidth + x1, 0, x2 - x1);
+		}
+	}
+
+	//Keep the nearest KBUFFER_LAYERS fragments, the farthest one is blended on overflow.
+	void InsertFragment(int index, float depth, const Color& color)
+	{
+		Fragment fragment;
+		fragment.depth = depth;
+		fragment.color = (color.a << 24) | (color.r << 16) | (color.g << 8) | color.b;
+		fragment.blendMode = mBlendMode;
+
+		Fragment* fragments = mFragments + index * KBUFFER_LAYERS;
+		if (mFragmentCounts[index] < KBUFFER_LAYERS)
+		{
+			fragments[mFragmentCounts[index]++] = fragment;
+			return;
+		}
+
+		int farthest = 0;
+		for (int i = 1; i < KBUFFER_LAYERS; i++)
+		{
+			if (fragments[i].depth > fragments[farthest].depth) farthest = i;
+		}
+		if (fragments[farthest].depth > fragment.depth)
+		{
+			Fragment evicted = fragments[farthest];
+			fragments[farthest] = fragment;
+			fragment = evicted;
+		}
+		mSpans[fragment.blendMode].Push(index * 3, UnpackColor(fragment.color));
+	}
+
+	static Color UnpackColor(unsigned int value)
+	{
+		return Color((value >> 16) & 0xff, (value >> 8) & 0xff, value & 0xff, (value >> 24) & 0xff);
+	}
+
+	//Route a shaded pixel to the opaque write, the blend span or the k-buffer.
+	void ShadePixel(int x, int y, float z, const Color& color, float u = 0, float v = 0)
+	{
+		if (BLEND_NONE == mBlendMode)
+		{
+			if (IsDeferred()) SetGBuffer(x, y, z, color, u, v);
+			else SetPiexel(x, y, z, color);
+			return;
+		}
+
+		if (x < mScissor._x1 || y < mScissor._y1 || x >= mScissor._x2 || y >= mScissor._y2) return;
+		if (y * mWidth * 3 + x * 3 + 3 > mWidth * mHeight * PIX_BITS / 8) return;
+		if (!mZBuf->Test(y * mWidth + x, z, mDepthFunc, false)) return;
+
+		Color pixelColor = color;
+		pixelColor.a = color.a * mAlpha / 255;
+		if (mCollectFragments)
+			InsertFragment(y * mWidth + x, mZBuf->Reversed() ? -z : z, pixelColor);
+		else
+			mSpans[mBlendMode].Push((y * mWidth + x) * 3, pixelColor);
+	}
+
+	void FlushSpans()
+	{
+		for (int mode = BLEND_ALPHA; mode <= BLEND_MULTIPLY; mode++)
+		{
+			if (mSpans[mode].offsets.empty()) continue;
+			BlendSpan(mSpans[mode], (BLEND_MODE)mode);
+			mSpans[mode].Clear();
+		}
+	}
+
+	/* out = dst + (f(src, dst) - dst) * alpha, 4 pixels per SSE instruction, f is src for BLEND_ALPHA,
+	dst + src for BLEND_ADDITIVE and src * dst / 255 for BLEND_MULTIPLY.
+	https://www.khronos.org/opengl/wiki/Blending */
+	void BlendSpan(PixelSpan& span, BLEND_MODE mode)
+	{
+		int count = span.offsets.size();
+		int padded = (count + 3) & ~3;
+		span.r.resize(padded); span.g.resize(padded); span.b.resize(padded); span.a.resize(padded);
+		span.dstR.resize(padded); span.dstG.resize(padded); span.dstB.resize(padded);
+
+		for (int i = 0; i < count; i++)
+		{
+			BYTE* pixel = mBuf + span.offsets[i];
+			span.dstG[i] = pixel[1];
+			span.dstR[i] = pixel[2];
+			span.dstB[i] = pixel[3];
+		}
+
+		const __m128 inv255 = _mm_set1_ps(1.0f / 255);
+		for (int i = 0; i < padded; i += 4)
+		{
+			__m128 alpha = _mm_mul_ps(_mm_loadu_ps(&span.a[i]), inv255);
+			_mm_storeu_ps(&span.dstR[i], BlendChannel(_mm_loadu_ps(&span.r[i]), _mm_loadu_ps(&span.dstR[i]), alpha, mode));
+			_mm_storeu_ps(&span.dstG[i], BlendChannel(_mm_loadu_ps(&span.g[i]), _mm_loadu_ps(&span.dstG[i]), alpha, mode));
+			_mm_storeu_ps(&span.dstB[i], BlendChannel(_mm_loadu_ps(&span.b[i]), _mm_loadu_ps(&span.dstB[i]), alpha, mode));
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			BYTE* pixel = mBuf + span.offsets[i];
+			pixel[1] = (BYTE)span.dstG[i];
+			pixel[2] = (BYTE)span.dstR[i];
+			pixel[3] = (BYTE)span.dstB[i];
+		}
+	}
+
+	static __m128 BlendChannel(__m128 src, __m128 dst, __m128 alpha, BLEND_MODE mode)
+	{
+		__m128 target = src;
+		if (BLEND_ADDITIVE == mode) target = _mm_add_ps(dst, src);
+		else if (BLEND_MULTIPLY == mode) target = _mm_mul_ps(_mm_mul_ps(src, dst), _mm_set1_ps(1.0f / 255));
+
+		__m128 out = _mm_add_ps(dst, _mm_mul_ps(_mm_sub_ps(target, dst), alpha));
+		out = _mm_min_ps(_mm_max_ps(out, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+
+		return _mm_add_ps(out, _mm_set1_ps(0.5f));
+	}
+
+	//Convert rows y1 to y2 of ReadPixels, YUV420 widens the range to whole row pairs.
+	void ReadRows(PIXEL_FORMAT format, void* dst, int pitch, int y1, int y2)
+	{
+		if (NULL == dst) return;
+		if (PIXEL_DEPTH_LINEAR == format)
+		{
+			ReadDepth((BYTE*)dst, pitch ? pitch : mWidth * sizeof(float), y1, y2);
+			return;
+		}
+		if (NULL == mBuf) return;
+		if (PIXEL_YUV420 == format)
+		{
+			ReadYUV((BYTE*)dst, pitch ? pitch : mWidth, y1, y2);
+			return;
+		}
+
+		int pixelBytes = (PIXEL_RGB565 == format) ? 2 : ((PIXEL_RGB_FLOAT == format) ? 12 : 4);
+		BYTE* out = (BYTE*)dst;
+		if (0 == pitch) pitch = mWidth * pixelBytes;
+		mWorkers.For(y2 - y1, [&](int row)
+		{
+			ConvertRow(format, y1 + row, out + (y1 + row) * pitch);
+		});
+	}
+
+	void ConvertRow(PIXEL_FORMAT format, int y, BYTE* out)
+	{
+		const __m128i alpha = _mm_set1_epi32(0xff000000);
+		const __m128 scale = _mm_set1_ps(1.0f / 255);
+		int index = y * mWidth, x = 0;
+
+		for (; x + 4 <= mWidth && CanLoadPixels(index + x); x += 4)
+		{
+			__m128i r, g, b;
+			LoadPixels(index + x, r, g, b);
+			switch (format)
+			{
+			case PIXEL_RGBA8:
+				_mm_storeu_si128((__m128i*)(out + x * 4), _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), alpha)));
+				break;
+			case PIXEL_BGRA8:
+				_mm_storeu_si128((__m128i*)(out + x * 4), _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(r, 16), alpha)));
+				break;
+			case PIXEL_RGB565:
+			{
+				__m128i value = _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(r, 3), 11), _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(g, 2), 5), _mm_srli_epi32(b, 3)));
+				//sign extend so the saturating pack keeps all 16 bits.
+				value = _mm_srai_epi32(_mm_slli_epi32(value, 16), 16);
+				_mm_storel_epi64((__m128i*)(out + x * 2), _mm_packs_epi32(value, value));
+				break;
+			}
+			case PIXEL_RGB_FLOAT:
+			{
+				__m128 red = _mm_mul_ps(_mm_cvtepi32_ps(r), scale);
+				__m128 green = _mm_mul_ps(_mm_cvtepi32_ps(g), scale);
+				__m128 blue = _mm_mul_ps(_mm_cvtepi32_ps(b), scale);
+				//r0 g0 r1 g1 and r2 g2 r3 g3, then interleave blue into 3 registers.
+				__m128 low = _mm_unpacklo_ps(red, green), high = _mm_unpackhi_ps(red, green);
+				float* dst = (float*)(out + x * 12);
+				_mm_storeu_ps(dst, _mm_shuffle_ps(low, _mm_shuffle_ps(blue, low, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 0, 1, 0)));
+				_mm_storeu_ps(dst + 4, _mm_shuffle_ps(_mm_shuffle_ps(low, blue, _MM_SHUFFLE(1, 1, 3, 3)), high, _MM_SHUFFLE(1, 0, 2, 0)));
+				__m128 tail = _mm_shuffle_ps(blue, high, _MM_SHUFFLE(3, 2, 3, 2));
+				_mm_storeu_ps(dst + 8, _mm_shuffle_ps(tail, tail, _MM_SHUFFLE(1, 3, 2, 0)));
+				break;
+			}
+			default:
+				return;
+			}
+		}
+
+		for (; x < mWidth; x++)
+		{
+			int r, g, b;
+			ReadPixel(index + x, r, g, b);
+			switch (format)
+			{
+			case PIXEL_RGBA8:
+				out[x * 4] = r; out[x * 4 + 1] = g; out[x * 4 + 2] = b; out[x * 4 + 3] = 255;
+				break;
+			case PIXEL_BGRA8:
+				out[x * 4] = b; out[x * 4 + 1] = g; out[x * 4 + 2] = r; out[x * 4 + 3] = 255;
+				break;
+			case PIXEL_RGB565:
+			{
+				int value = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+				out[x * 2] = value & 0xff;
+				out[x * 2 + 1] = value >> 8;
+				break;
+			}
+			case PIXEL_RGB_FLOAT:
+			{
+				float* dst = (float*)(out + x * 12);
+				//same reciprocal as the SSE path, so a pixel converts alike in any column.
+				dst[0] = r * (1.0f / 255); dst[1] = g * (1.0f / 255); dst[2] = b * (1.0f / 255);
+				break;
+			}
+			default:
+				return;
+			}
+		}
+	}
+
+	//BT.601 limited range, one task per pair of rows so each task owns a row of both chroma planes.
+	void ReadYUV(BYTE* dst, int pitch, int y1, int y2)
+	{
+		int chromaHeight = (mHeight + 1) / 2, chromaPitch = (pitch + 1) / 2;
+		int firstRow = y1 / 2, lastRow = (y2 + 1) / 2;
+		BYTE* planeU = dst + pitch * mHeight;
+		BYTE* planeV = planeU + chromaPitch * chromaHeight;
+
+		mWorkers.For(lastRow - firstRow, [&](int task)
+		{
+			int row = firstRow + task;
+			int y0 = row * 2, y1 = min(y0 + 1, mHeight - 1);
+			BYTE* luma0 = dst + y0 * pitch;
+			BYTE* luma1 = dst + y1 * pitch;
+			BYTE* u = planeU + row * chromaPitch;
+			BYTE* v = planeV + row * chromaPitch;
+			int x = 0;
+
+			for (; x + 8 <= mWidth && CanLoadPixels(y1 * mWidth + x + 4); x += 8)
+			{
+				__m128i r[4], g[4], b[4];
+				LoadPixels(y0 * mWidth + x, r[0], g[0], b[0]);
+				LoadPixels(y0 * mWidth + x + 4, r[1], g[1], b[1]);
+				LoadPixels(y1 * mWidth + x, r[2], g[2], b[2]);
+				LoadPixels(y1 * mWidth + x + 4, r[3], g[3], b[3]);
+
+				__m128i top = _mm_packs_epi32(Luma(r[0], g[0], b[0]), Luma(r[1], g[1], b[1]));
+				__m128i bottom = _mm_packs_epi32(Luma(r[2], g[2], b[2]), Luma(r[3], g[3], b[3]));
+				_mm_storel_epi64((__m128i*)(luma0 + x), _mm_packus_epi16(top, top));
+				_mm_storel_epi64((__m128i*)(luma1 + x), _mm_packus_epi16(bottom, bottom));
+
+				__m128i red = Average(_mm_add_epi32(r[0], r[2]), _mm_add_epi32(r[1], r[3]));
+				__m128i green = Average(_mm_add_epi32(g[0], g[2]), _mm_add_epi32(g[1], g[3]));
+				__m128i blue = Average(_mm_add_epi32(b[0], b[2]), _mm_add_epi32(b[1], b[3]));
+				__m128i chromaU = _mm_packs_epi32(Chroma(red, green, blue, -38, -74, 112), _mm_setzero_si128());
+				__m128i chromaV = _mm_packs_epi32(Chroma(red, green, blue, 112, -94, -18), _mm_setzero_si128());
+				int valueU = _mm_cvtsi128_si32(_mm_packus_epi16(chromaU, chromaU));
+				int valueV = _mm_cvtsi128_si32(_mm_packus_epi16(chromaV, chromaV));
+				memcpy(u + x / 2, &valueU, 4);
+				memcpy(v + x / 2, &valueV, 4);
+			}
+
+			for (; x < mWidth; x += 2)
+			{
+				int x1 = min(x + 1, mWidth - 1), sumR = 0, sumG = 0, sumB = 0;
+				int indices[4] = { y0 * mWidth + x, y0 * mWidth + x1, y1 * mWidth + x, y1 * mWidth + x1 };
+				for (int i = 0; i < 4; i++)
+				{
+					int r, g, b;
+					ReadPixel(indices[i], r, g, b);
+					BYTE luma = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+					(i < 2 ? luma0 : luma1)[(i & 1) ? x1 : x] = luma;
+					sumR += r; sumG += g; sumB += b;
+				}
+				sumR = (sumR + 2) >> 2; sumG = (sumG + 2) >> 2; sumB = (sumB + 2) >> 2;
+				u[x / 2] = ((-38 * sumR - 74 * sumG + 112 * sumB + 128) >> 8) + 128;
+				v[x / 2] = ((112 * sumR - 94 * sumG - 18 * sumB + 128) >> 8) + 128;
+			}
+		});
+	}
+
+	/* z = m32 / (d - m22) inverts the projection of Camera::Perspective and PerspectiveReversed.
+	Cleared pixels read the far plane, or FLT_MAX for DEPTH_FLOAT. */
+	void ReadDepth(BYTE* dst, int pitch, int y1, int y2)
+	{
+		const __m128 m22 = _mm_set1_ps(mProjection.mm[2][2]), m32 = _mm_set1_ps(mProjection.mm[3][2]);
+		const __m128 empty = _mm_set1_ps(FLT_MAX), zero = _mm_setzero_ps();
+
+		mWorkers.For(y2 - y1, [&](int task)
+		{
+			int y = y1 + task;
+			float* row = (float*)(dst + y * pitch);
+			int x = 0;
+			for (; x < mWidth; x++) row[x] = mZBuf->Read(y * mWidth + x);
+
+			for (x = 0; x + 4 <= mWidth; x += 4)
+			{
+				__m128 z = _mm_div_ps(m32, _mm_sub_ps(_mm_loadu_ps(row + x), m22));
+				__m128 valid = _mm_cmpgt_ps(z, zero);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(valid, z), _mm_andnot_ps(valid, empty)));
+			}
+			for (; x < mWidth; x++)
+			{
+				float z = mProjection.mm[3][2] / (row[x] - mProjection.mm[2][2]);
+				row[x] = (z > 0) ? z : FLT_MAX;
+			}
+		});
+	}
+
+	//LoadPixels reads 16 bytes from the second byte of pixel index.
+	bool CanLoadPixels(int index)
+	{
+		return index * 3 + 17 <= mWidth * mHeight * PIX_BITS / 8;
+	}
+
+	//4 pixels from index into 32 bit lanes, see SetPiexel for the g, r, b layout at offset 1.
+	void LoadPixels(int index, __m128i& r, __m128i& g, __m128i& b)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(mBuf + index * 3 + 1));
+		__m128i lanes = _mm_and_si128(bytes, _mm_setr_epi32(0xffffff, 0, 0, 0));
+		lanes = _mm_or_si128(lanes, _mm_and_si128(_mm_slli_si128(bytes, 1), _mm_setr_epi32(0, 0xffffff, 0, 0)));
+		lanes = _mm_or_si128(lanes, _mm_and_si128(_mm_slli_si128(bytes, 2), _mm_setr_epi32(0, 0, 0xffffff, 0)));
+		lanes = _mm_or_si128(lanes, _mm_and_si128(_mm_slli_si128(bytes, 3), _mm_setr_epi32(0, 0, 0, 0xffffff)));
+
+		__m128i mask = _mm_set1_epi32(0xff);
+		g = _mm_and_si128(lanes, mask);
+		r = _mm_and_si128(_mm_srli_epi32(lanes, 8), mask);
+		b = _mm_srli_epi32(lanes, 16);
+	}
+
+	void ReadPixel(int index, int& r, int& g, int& b)
+	{
+		BYTE* p = mBuf + index * 3;
+		g = p[1];
+		r = p[2];
+		b = p[3];
+	}
+
+	//Sum of the 2x2 blocks from column sums of pixels 0-3 and 4-7, rounded down to the average.
+	static __m128i Average(__m128i low, __m128i high)
+	{
+		__m128 even = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1));
+		__m128i sum = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+
+		return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+	}
+
+	//Channels are below 256, so the weighted sums fit the low 16 bits of each lane and the high half stays 0.
+	static __m128i Luma(__m128i r, __m128i g, __m128i b)
+	{
+		__m128i sum = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi32(66)), _mm_mullo_epi16(g, _mm_set1_epi32(129)));
+		sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi32(25)), _mm_set1_epi32(128)));
+
+		return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi32(16));
+	}
+
+	static __m128i Chroma(__m128i r, __m128i g, __m128i b, int weightR, int weightG, int weightB)
+	{
+		__m128i sum = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi32(weightR & 0xffff)), _mm_mullo_epi16(g, _mm_set1_epi32(weightG & 0xffff)));
+		sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi32(weightB & 0xffff)), _mm_set1_epi32(128)));
+
+		return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi32(128));
+	}
+
+	void SetPiexel(int x, int y, float z, const Color& color)
+	{
+		if (NULL == mBuf) return;
+		if (x < mScissor._x1 || y < mScissor._y1 || x >= mScissor._x2 || y >= mScissor._y2) return;
+		if (y * mWidth * 3 + x * 3 + 3 > mWidth * mHeight * PIX_BITS / 8) return;
+
+		if (mZBuf->Test(y * mWidth + x, z, mDepthFunc))
+		{
+			mBuf[y * mWidth * 3 + x * 3 + 1] = color.g;
+			mBuf[y * mWidth * 3 + x * 3 + 2] = color.r;
+			mBuf[y * mWidth * 3 + x * 3 + 3] = color.b;
+			//a forward shaded pixel on top must not be lit again.
+			if (IsDeferred()) mGBuffer[y * mWidth + x].albedo = 0;
+		}
+	}
+
+	bool IsDeferred()
+	{
+		return mDeferred && NULL == mRenderTarget;
+	}
+
+	void GetTargetPixel(float u, float v, Color& outColor)
+	{
+		int xPos = min((int)(mTextureTarget->width * u), mTextureTarget->width - 1);
+		int yPos = min((int)(mTextureTarget->height * v), mTextureTarget->height - 1);
+		int index = yPos * mTextureTarget->width + xPos;
+
+		if (NULL == mTextureTarget->color)
+		{
+			int value = Math::Clamp(mTextureTarget->depth->Read(index)) * 255;
+			outColor = Color(value, value, value);
+			return;
+		}
+
+		BYTE* pixel = mTextureTarget->color + index * 3;
+		outColor = Color(pixel[2], pixel[1], pixel[3]);
+	}
+
+	void SetGBuffer(int x, int y, float z, const Color& color, float u, float v)
+	{
+		if (x < mScissor._x1 || y < mScissor._y1 || x >= mScissor._x2 || y >= mScissor._y2) return;
+		if (y * mWidth * 3 + x * 3 + 3 > mWidth * mHeight * PIX_BITS / 8) return;
+		if (!mZBuf->Test(y * mWidth + x, z, mDepthFunc)) return;
+
+		GBufferTexel& texel = mGBuffer[y * mWidth + x];
+		texel.albedo = 0xff000000 | (color.r << 16) | (color.g << 8) | color.b;
+		texel.SetNormal(mNormal);
+		texel.u = (unsigned short)(Math::Clamp(u) * 65535);
+		texel.v = (unsigned short)(Math::Clamp(v) * 65535);
+	}
+
+	void DrawLine(Vector4 start, Vector4 end, Color color, bool readTexture = false)
+	{
+		Color pixelColor = color;
+		if (start.x == end.x && start.y == end.y)
+		{
+			ShadePixel(start.x, start.y, start.z, pixelColor);
+			FlushSpans();
+		}
+		else if (start.x == end.x)
+		{
+			for (int y = max(min(start.y, end.y), mScissor._y1); y < min(max(start.y, end.y), mScissor._y2); y++)
+			{
+				if (readTexture)
+				{
+					float u = Math::Interpolate3D(start.u, start.z, end.u, end.z, (y - start.y) / (end.y - start.y));
+					float v = Math::Interpolate3D(start.v, start.z, end.v, end.z, (y - start.y) / (end.y - start.y));
+					GetTexturePixel(u, v, pixelColor);
+					ShadePixel(start.x, y, Math::Interpolate(start.z, end.z, (y - start.y) / (end.y - start.y)), pixelColor, u, v);
+				}
+				
+			}
+			FlushSpans();
+		}
+		else if (start.y == end.y)
+		{
+			for (int x = min(start.x, end.x); x < max(start.x, end.x); x++)
+			{
+				float u = 0, v = 0;
+				if (readTexture)
+				{
+					u = Math::Interpolate3D(start.u, start.z, end.u, end.z, (x - start.x) / (end.x - start.x));
+					v = Math::Interpolate3D(start.v, start.z, end.v, end.z, (x - start.x) / (end.x - start.x));
+					GetTexturePixel(u, v, pixelColor);
+				}
+				ShadePixel(x, start.y, Math::Interpolate(start.z, end.z, (x - start.x) / (end.x - start.x)), pixelColor, u, v);
+			}
+			FlushSpans();
+		}
+	}
+
+	/* Integer Bresenham on the segment clipped to the scissor rectangle, z is linear in screen space after the divide.
+	Wide lines repeat every step across the minor axis.
+	https://en.wikipedia.org/wiki/Bresenham%27s_line_algorithm */
+	void DrawSegment(Vector4 start, Vector4 end, const Color& color, int width = 1)
+	{
+		if (!ClipSegment(start, end, width / 2)) return;
+
+		int x0 = floor(start.x), y0 = floor(start.y);
+		int x1 = floor(end.x), y1 = floor(end.y);
+		int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+		int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+		int err = dx + dy;
+		int steps = max(dx, -dy);
+		bool xMajor = dx >= -dy;
+		float z = start.z;
+		float zStep = steps > 0 ? (end.z - start.z) / steps : 0;
+
+		while (true)
+		{
+			for (int k = -(width - 1) / 2; k <= width / 2; k++)
+			{
+				if (xMajor) PlotPixel(x0, y0 + k, z, color);
+				else PlotPixel(x0 + k, y0, z, color);
+			}
+
+			if (x0 == x1 && y0 == y1) break;
+
+			int e2 = 2 * err;
+			if (e2 >= dy) { err += dy; x0 += sx; }
+			if (e2 <= dx) { err += dx; y0 += sy; }
+			z += zStep;
+		}
+		//every step moves along the major axis, so a segment never blends a pixel twice.
+		FlushSpans();
+	}
+
+	//Lines and points stay forward shaded, blended ones only come from the transparency pass. Depth only targets just write depth.
+	void PlotPixel(int x, int y, float z, const Color& color)
+	{
+		if (NULL == mBuf)
+		{
+			if (x >= mScissor._x1 && y >= mScissor._y1 && x < mScissor._x2 && y < mScissor._y2)
+				mZBuf->Test(y * mWidth + x, z, mDepthFunc);
+		}
+		else if (BLEND_NONE == mBlendMode) SetPiexel(x, y, z, color);
+		else ShadePixel(x, y, z, color);
+	}
+
+	/* Liang-Barsky against the scissor rectangle grown by margin.
+	https://en.wikipedia.org/wiki/Liang%E2%80%93Barsky_algorithm */
+	bool ClipSegment(Vector4& start, Vector4& end, float margin)
+	{
+		float dx = end.x - start.x, dy = end.y - start.y;
+		float p[4] = { -dx, dx, -dy, dy };
+		float q[4] = {
+			start.x - (mScissor._x1 - margin), (mScissor._x2 - 1 + margin) - start.x,
+			start.y - (mScissor._y1 - margin), (mScissor._y2 - 1 + margin) - start.y };
+		float t0 = 0, t1 = 1;
+
+		for (int i = 0; i < 4; i++)
+		{
+			if (p[i] == 0)
+			{
+				if (q[i] < 0) return false;
+				continue;
+			}
+
+			float t = q[i] / p[i];
+			if (p[i] < 0) t0 = max(t0, t);
+			else t1 = min(t1, t);
+		}
+		if (t0 > t1) return false;
+
+		Vector4 clippedStart = start;
+		clippedStart.x = start.x + t0 * dx;
+		clippedStart.y = start.y + t0 * dy;
+		clippedStart.z = Math::Interpolate(start.z, end.z, t0);
+		end.x = start.x + t1 * dx;
+		end.y = start.y + t1 * dy;
+		end.z = Math::Interpolate(start.z, end.z, t1);
+		start = clippedStart;
+
+		return true;
+	}
+
+	//Square sprites of size pixels, clamped to the scissor rectangle once per point.
+	void DrawPoints(const std::vector<Vector4>& points, int size, const Color& color)
+	{
+		for (int i = 0; i < points.size(); i++)
+		{
+			int left = floor(points[i].x) - (size - 1) / 2;
+			int top = floor(points[i].y) - (size - 1) / 2;
+			int x1 = max(left, (int)mScissor._x1), x2 = min(left + size, (int)mScissor._x2);
+			int y1 = max(top, (int)mScissor._y1), y2 = min(top + size, (int)mScissor._y2);
+
+			for (int y = y1; y < y2; y++)
+			{
+				for (int x = x1; x < x2; x++)
+					PlotPixel(x, y, points[i].z, color);
+			}
+			FlushSpans();
+		}
+	}
+
+	void DrawArea(Vector4 point1, Vector4 point2, Vector4 point3, Color color)
+	{
+		int minX = min(point1.x, min(point2.x, point3.x)) - 0.5f;
+		int maxX = max(point1.x, max(point2.x, point3.x)) + 0.5f;
+		minX = max(minX, (int)mScissor._x1);
+		maxX = min(maxX, (int)mScissor._x2);
+		Vector4 startScan, endScan;
+
+		for (int i = minX; i < maxX; i++)
 		{
 			if (ScanLineInX(point1, point2, point3, i, startScan, endScan))
 				DrawLine(startScan, endScan, color, true);
 		}
 	}
 	
+	//Depth only path, no uv, texture or color work, z is linear down each column.
+	void DrawDepthArea(Vector4 point1, Vector4 point2, Vector4 point3)
+	{
+		int minX = min(point1.x, min(point2.x, point3.x)) - 0.5f;
+		int maxX = max(point1.x, max(point2.x, point3.x)) + 0.5f;
+		minX = max(minX, (int)mScissor._x1);
+		maxX = min(maxX, (int)mScissor._x2);
+		Vector4 startScan, endScan;
+
+		for (int x = minX; x < maxX; x++)
+		{
+			if (!ScanLineInX(point1, point2, point3, x, startScan, endScan)) continue;
+
+			if (startScan.y == endScan.y)
+			{
+				if (startScan.y >= mScissor._y1 && startScan.y < mScissor._y2)
+					mZBuf->Test((int)startScan.y * mWidth + x, startScan.z, mDepthFunc);
+				continue;
+			}
+
+			if (startScan.y > endScan.y)
+			{
+				Vector4 temp = startScan; startScan = endScan; endScan = temp;
+			}
+			int yBegin = max((int)startScan.y, (int)mScissor._y1);
+			float yEnd = min(endScan.y, mScissor._y2);
+			float zStep = (endScan.z - startScan.z) / (endScan.y - startScan.y);
+
+			for (int y = yBegin; y < yEnd; y++)
+				mZBuf->Test(y * mWidth + x, startScan.z + max(y - startScan.y, 0.0f) * zStep, mDepthFunc);
+		}
+	}
+
 	Vector4 OnLine(Vector4& start, Vector4& end, int x)
 	{
 		Vector4 point(0, 0, 0, -1);
@@ -724,6 +2647,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 	}
 	case WM_PAINT:
 	{
+		if (device) device->Invalidate();
 		break;
 	}
 	case WM_CHAR:
@@ -820,6 +2744,20 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR sZCmdLine,
 
 	device = new Device(hwnd);
 	device->InitTexture(256, 256);
+	device->SetIncremental(true);
+	device->SetDeferred(true);
+
+	Light sunLight;
+	sunLight.direction = Vector4(-0.3f, -1, -0.5f).Normalize();
+	sunLight.intensity = 0.6f;
+	device->AddLight(sunLight);
+
+	Light pointLight;
+	pointLight.type = LIGHT_POINT;
+	pointLight.position = Vector4(1.5f, 1.5f, 2);
+	pointLight.color = Color(255, 200, 150);
+	pointLight.range = 5;
+	device->AddLight(pointLight);
 	transform.type = DRAW_TRIANGLE;
 	transform.worldMatrix = worldMatrix4;
 	transform.viewMatrix = viewMatrix4;